@@ -0,0 +1,309 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/skbuff.h>
+#include <linux/timex.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
+#include "mod/target.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva <ydahhrk@gmail.com>");
+MODULE_DESCRIPTION("Microbenchmarks for xt_MARKSRCRANGE");
+
+static unsigned int iterations = 1 << 16;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "Packets per measurement, per CPU.");
+
+static unsigned int plen_step = 16;
+module_param(plen_step, uint, 0444);
+MODULE_PARM_DESC(plen_step, "Distance between the --source lengths tested.");
+
+static unsigned int delta_step = 8;
+module_param(delta_step, uint, 0444);
+MODULE_PARM_DESC(delta_step, "Distance between the sub-prefix length deltas tested.");
+
+/*
+ * The packets each measurement cycles through. They all have different
+ * sources, so the CPU cannot get too comfortable.
+ * Must be a power of two.
+ */
+#define SKB_COUNT 64
+
+enum bench_function {
+	BENCH_SRC_TO_MARK,
+	BENCH_CHANGE_MARK_CONTINUE,
+	BENCH_CHANGE_MARK_ACCEPT,
+	BENCH_FUNCTION_COUNT,
+};
+
+static const char *FUNCTION_NAMES[] = {
+	"src_to_mark",
+	"change_mark",
+	"change_mark/ACCEPT",
+};
+
+/**
+ * A single measurement, run on a single CPU.
+ */
+struct bench_job {
+	struct xt_marksrcrange_tginfo cfg;
+	enum bench_function function;
+	struct sk_buff **skbs;
+
+	/* Output. */
+	u64 ns;
+	u64 cycles;
+};
+
+/**
+ * Per-function statistics, across CPUs.
+ */
+struct bench_stats {
+	u64 min_ns;
+	u64 max_ns;
+	u64 total_ns;
+	u64 total_cycles;
+	unsigned int cpus;
+};
+
+/* Keeps the compiler from optimizing the measured calls away. */
+static volatile __u32 sink;
+
+/**
+ * Returns (in @result) a random address from @prefix.
+ */
+static void random_member(const struct ipv6_prefix *prefix,
+		struct in6_addr *result)
+{
+	struct in6_addr noise;
+	struct in6_addr noise_prefix;
+	unsigned int i;
+
+	get_random_bytes(&noise, sizeof(noise));
+	ipv6_addr_prefix(&noise_prefix, &noise, prefix->len);
+	ipv6_addr_prefix(result, &prefix->address, prefix->len);
+
+	for (i = 0; i < 4; i++) {
+		result->s6_addr32[i] |= noise.s6_addr32[i]
+				^ noise_prefix.s6_addr32[i];
+	}
+}
+
+static struct sk_buff *create_skb(const struct ipv6_prefix *prefix)
+{
+	struct sk_buff *skb;
+	struct ipv6hdr *hdr;
+
+	skb = alloc_skb(sizeof(*hdr), GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reset_network_header(skb);
+	hdr = (struct ipv6hdr *)skb_put(skb, sizeof(*hdr));
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = 6;
+	random_member(prefix, &hdr->saddr);
+
+	return skb;
+}
+
+static void destroy_skbs(struct sk_buff **skbs)
+{
+	unsigned int i;
+
+	for (i = 0; i < SKB_COUNT; i++)
+		kfree_skb(skbs[i]);
+}
+
+static int create_skbs(const struct ipv6_prefix *prefix,
+		struct sk_buff **skbs)
+{
+	unsigned int i;
+
+	memset(skbs, 0, SKB_COUNT * sizeof(*skbs));
+	for (i = 0; i < SKB_COUNT; i++) {
+		skbs[i] = create_skb(prefix);
+		if (!skbs[i]) {
+			destroy_skbs(skbs);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Runs @arg's measurement. Meant to be bound to a CPU via work_on_cpu().
+ */
+static long bench_cpu(void *arg)
+{
+	struct bench_job *job = arg;
+	struct xt_action_param param;
+	struct sk_buff **skbs = job->skbs;
+	ktime_t start;
+	cycles_t start_cycles;
+	__u32 result = 0;
+	unsigned int i;
+
+	memset(&param, 0, sizeof(param));
+	param.targinfo = &job->cfg;
+
+	/* Packets are normally processed in softirq context. */
+	local_bh_disable();
+	start = ktime_get();
+	start_cycles = get_cycles();
+
+	switch (job->function) {
+	case BENCH_SRC_TO_MARK:
+		for (i = 0; i < iterations; i++) {
+			result ^= src_to_mark(
+					&ipv6_hdr(skbs[i & (SKB_COUNT - 1)])->saddr,
+					&job->cfg);
+		}
+		break;
+	case BENCH_CHANGE_MARK_CONTINUE:
+	case BENCH_CHANGE_MARK_ACCEPT:
+		for (i = 0; i < iterations; i++)
+			result ^= change_mark(skbs[i & (SKB_COUNT - 1)], &param);
+		break;
+	case BENCH_FUNCTION_COUNT:
+		break;
+	}
+
+	job->cycles = get_cycles() - start_cycles;
+	job->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	local_bh_enable();
+
+	sink = result;
+	return 0;
+}
+
+/**
+ * Prints @value / @divisor with two decimals.
+ */
+static void print_ratio(char *buffer, size_t size, u64 value, u64 divisor)
+{
+	u64 centi = div64_u64(value * 100, divisor);
+	u32 decimals;
+
+	centi = div_u64_rem(centi, 100, &decimals);
+	snprintf(buffer, size, "%llu.%02u", centi, decimals);
+}
+
+static void print_stats(struct xt_marksrcrange_tginfo *cfg,
+		enum bench_function function, struct bench_stats *stats)
+{
+	char avg[32];
+	char min[32];
+	char max[32];
+	char cycles[32];
+
+	print_ratio(avg, sizeof(avg), stats->total_ns,
+			(u64)stats->cpus * iterations);
+	print_ratio(min, sizeof(min), stats->min_ns, iterations);
+	print_ratio(max, sizeof(max), stats->max_ns, iterations);
+	print_ratio(cycles, sizeof(cycles), stats->total_cycles,
+			(u64)stats->cpus * iterations);
+
+	pr_info("/%u/%u %-18s %s ns/pkt (min %s, max %s across %u CPUs), %s cycles/pkt\n",
+			cfg->prefix.len, cfg->sub_prefix_len,
+			FUNCTION_NAMES[function], avg, min, max, stats->cpus,
+			cycles);
+}
+
+static int bench_function(struct bench_job *job)
+{
+	struct bench_stats stats;
+	unsigned int cpu;
+	long error;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.min_ns = ~((u64)0);
+
+	for_each_online_cpu(cpu) {
+		error = work_on_cpu(cpu, bench_cpu, job);
+		if (error)
+			return error;
+
+		stats.min_ns = min(stats.min_ns, job->ns);
+		stats.max_ns = max(stats.max_ns, job->ns);
+		stats.total_ns += job->ns;
+		stats.total_cycles += job->cycles;
+		stats.cpus++;
+	}
+
+	print_stats(&job->cfg, job->function, &stats);
+	return 0;
+}
+
+static int bench_shape(__u8 plen, __u8 splen)
+{
+	struct sk_buff *skbs[SKB_COUNT];
+	struct bench_job job;
+	enum bench_function function;
+	int error;
+
+	memset(&job, 0, sizeof(job));
+	/* The algorithm does not depend on this, so whatever it. */
+	job.cfg.prefix.address.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	job.cfg.prefix.len = plen;
+	job.cfg.sub_prefix_len = splen;
+	job.skbs = skbs;
+
+	error = create_skbs(&job.cfg.prefix, skbs);
+	if (error)
+		return error;
+
+	for (function = 0; function < BENCH_FUNCTION_COUNT; function++) {
+		job.function = function;
+		job.cfg.verdict = (function == BENCH_CHANGE_MARK_ACCEPT)
+				? MSR_VERDICT_ACCEPT
+				: MSR_VERDICT_CONTINUE;
+		error = bench_function(&job);
+		if (error)
+			break;
+	}
+
+	destroy_skbs(skbs);
+	return error;
+}
+
+static int msr_init(void)
+{
+	unsigned int plen;
+	unsigned int delta;
+	int error;
+
+	if (iterations == 0 || plen_step == 0 || delta_step == 0) {
+		pr_err("iterations, plen_step and delta_step must be positive.\n");
+		return -EINVAL;
+	}
+
+	pr_info("Starting xt_MARKSRCRANGE benchmarks. (%u packets per measurement)\n",
+			iterations);
+
+	for (plen = 0; plen <= 128; plen += plen_step) {
+		for (delta = 0; delta <= 32; delta += delta_step) {
+			if (plen + delta > 128)
+				break;
+			error = bench_shape(plen, plen + delta);
+			if (error) {
+				pr_err("Benchmark failed: error %d.\n", error);
+				return error;
+			}
+		}
+	}
+
+	pr_info("Done.\n");
+	return 0;
+}
+
+static void msr_exit(void)
+{
+	/* No code. */
+}
+
+module_init(msr_init);
+module_exit(msr_exit);
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Measures how long ip6tables takes to append a MARKSRCRANGE rule to, and to
+# replace, a mangle PREROUTING chain that already holds N MARKSRCRANGE rules.
+#
+# Usage: sudo ./rules.sh [N...]
+# (Defaults to 1000 10000 100000.)
+#
+# Warning: Flushes mangle PREROUTING, before and after. (Only that chain; the
+# rest of the mangle table is left alone.)
+
+set -e
+
+if [ $# -eq 0 ]; then
+	set -- 1000 10000 100000
+fi
+
+TMP=$(mktemp)
+trap 'rm -f "$TMP"; ip6tables -t mangle -F PREROUTING' EXIT
+
+now() {
+	date +%s%N
+}
+
+# Prints the elapsed milliseconds since $1.
+elapsed() {
+	echo $((($(now) - $1) / 1000000))
+}
+
+# Prints an ip6tables-restore file that replaces PREROUTING with $1
+# MARKSRCRANGE rules. (Meant for --noflush, so the other chains survive.)
+# Rule i marks 2001:db8:<i / 65536>:<i % 65536>::/120 (in hex) as 256i through
+# 256i + 255.
+generate() {
+	echo "*mangle"
+	echo "-F PREROUTING"
+	i=0
+	while [ $i -lt $1 ]; do
+		printf "%s -s 2001:db8:%x:%x::/120 -j MARKSRCRANGE --mark-offset %u\n" \
+				"-A PREROUTING" $((i >> 16)) $((i & 0xffff)) $((i * 256))
+		i=$((i + 1))
+	done
+	echo "COMMIT"
+}
+
+echo "Rules	Load (ms)	Append (ms)	Replace (ms)"
+
+for N in "$@"; do
+	ip6tables -t mangle -F PREROUTING
+	generate "$N" > "$TMP"
+
+	# Empty chain -> N rules.
+	START=$(now)
+	ip6tables-restore --noflush < "$TMP"
+	LOAD=$(elapsed "$START")
+
+	# N rules -> N + 1 rules.
+	START=$(now)
+	ip6tables -t mangle -A PREROUTING -s 2001:db8:ffff::/120 \
+			-j MARKSRCRANGE --mark-offset 0
+	APPEND=$(elapsed "$START")
+
+	# N + 1 rules -> N rules. (Same configurations, brand new table.)
+	START=$(now)
+	ip6tables-restore --noflush < "$TMP"
+	REPLACE=$(elapsed "$START")
+
+	echo "$N	$LOAD		$APPEND		$REPLACE"
+done
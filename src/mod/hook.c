@@ -1,4 +1,5 @@
 #include <linux/module.h>
+#include "registry.h"
 #include "target.h"
 
 MODULE_LICENSE("GPL");
@@ -6,16 +7,51 @@ MODULE_AUTHOR("Alberto Leiva <ydahhrk@gmail.com>");
 MODULE_DESCRIPTION("Marks packets depending on source address");
 MODULE_ALIAS("ip6t_MARKSRCRANGE");
 
-static struct xt_target marksrcrange_tg_reg __read_mostly = {
-	.name           = "MARKSRCRANGE",
-	.revision       = 0,
-	.family         = NFPROTO_IPV6,
-	.hooks          = 1 << NF_INET_PRE_ROUTING,
-	.table          = "mangle",
-	.checkentry     = check_entry,
-	.target         = change_mark,
-	.targetsize     = sizeof(struct xt_marksrcrange_tginfo),
-	.me             = THIS_MODULE,
+/**
+ * Called when the kernel wants us to validate an entry the user is adding.
+ * (registry_add() takes care of check_entry().)
+ */
+static int marksrcrange_tg_check(const struct xt_tgchk_param *param)
+{
+	return registry_add(param);
+}
+
+/**
+ * Called when a rule that passed marksrcrange_tg_check() is removed.
+ */
+static void marksrcrange_tg_destroy(const struct xt_tgdtor_param *param)
+{
+	registry_rm(param->net, param->targinfo);
+}
+
+static struct xt_target marksrcrange_tg_reg[] __read_mostly = {
+	/*
+	 * Predates --verdict and the registry. Kept so rules appended by older
+	 * userspace plugins still work, but the in-kernel API ignores them.
+	 */
+	{
+		.name           = "MARKSRCRANGE",
+		.revision       = 0,
+		.family         = NFPROTO_IPV6,
+		.hooks          = 1 << NF_INET_PRE_ROUTING,
+		.table          = "mangle",
+		.checkentry     = check_entry_v0,
+		.target         = change_mark_v0,
+		.targetsize     = sizeof(struct xt_marksrcrange_tginfo_v0),
+		.me             = THIS_MODULE,
+	},
+	{
+		.name           = "MARKSRCRANGE",
+		.revision       = 1,
+		.family         = NFPROTO_IPV6,
+		.hooks          = 1 << NF_INET_PRE_ROUTING,
+		.table          = "mangle",
+		.checkentry     = marksrcrange_tg_check,
+		.destroy        = marksrcrange_tg_destroy,
+		.target         = change_mark,
+		.targetsize     = sizeof(struct xt_marksrcrange_tginfo),
+		.me             = THIS_MODULE,
+	},
 };
 
 /**
@@ -25,8 +61,19 @@ static struct xt_target marksrcrange_tg_reg __read_mostly = {
 static int __init marksrcrange_tg_init(void)
 {
 	int error;
-	error = xt_register_target(&marksrcrange_tg_reg);
-	return (error < 0) ? error : 0;
+
+	error = registry_init();
+	if (error)
+		return error;
+
+	error = xt_register_targets(marksrcrange_tg_reg,
+			ARRAY_SIZE(marksrcrange_tg_reg));
+	if (error < 0) {
+		registry_destroy();
+		return error;
+	}
+
+	return 0;
 }
 
 /**
@@ -34,7 +81,9 @@ static int __init marksrcrange_tg_init(void)
  */
 static void __exit marksrcrange_tg_exit(void)
 {
-	xt_unregister_target(&marksrcrange_tg_reg);
+	xt_unregister_targets(marksrcrange_tg_reg,
+			ARRAY_SIZE(marksrcrange_tg_reg));
+	registry_destroy();
 }
 
 module_init(marksrcrange_tg_init);
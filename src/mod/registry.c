@@ -0,0 +1,681 @@
+#include "registry.h"
+
+#include <linux/bug.h>
+#include <linux/hashtable.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/jhash.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <net/netns/hash.h>
+#include "target.h"
+
+/*
+ * The README promises kernel 3.13, so keep building there.
+ * (Interval trees only take cached roots since 4.14.)
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#define MARK_TREE_ROOT struct rb_root_cached
+#define MARK_TREE_EMPTY RB_ROOT_CACHED
+#else
+#define MARK_TREE_ROOT struct rb_root
+#define MARK_TREE_EMPTY RB_ROOT
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+/*
+ * The registry is the set of MARKSRCRANGE rules that currently live in the
+ * kernel. Other modules (eg. Jool) query it to find out which client owns a
+ * mark, or which mark a client gets.
+ *
+ * Every network namespace has its own tables, so every namespace gets its own
+ * registry (struct msr_net); rules from one namespace never answer another
+ * namespace's queries.
+ *
+ * Writers (rule additions and removals) are serialized by @registry_mutex and
+ * operate on @rules. Whenever they change a namespace's rules, they schedule
+ * its @reindex_work, which builds a brand new (read-only) index and publishes
+ * it via RCU, so readers never lock.
+ *
+ * The kernel validates every rule of a table whenever any of them changes, so
+ * this needs to scale. @rules is a hash table keyed by the rule's namespace
+ * and configuration; a rule whose configuration is already known (which is
+ * almost all of them during a table replacement) costs one hash lookup, and
+ * the index is only rebuilt once per burst of changes.
+ */
+
+/**
+ * Everything that defines a MARKSRCRANGE rule, as check_entry() receives it.
+ * All 32-bit words, so it can be hashed and compared as a whole.
+ */
+struct msr_key {
+	struct in6_addr src;
+	struct in6_addr smsk;
+	__u32 mark_offset;
+	__u32 sub_prefix_len;
+	__u32 verdict;
+	__u32 src_inverted;
+};
+
+/**
+ * A validated configuration, shared by all the ip6tables rules that have it.
+ *
+ * Rules that use "! --source" are kept here (so they can be accounted for),
+ * but they are left out of the index; the mark they assign has nothing to do
+ * with the prefix.
+ */
+struct msr_rule {
+	/** The namespace whose tables hold the rules. Also part of the key. */
+	struct net *net;
+	struct msr_key key;
+	/** Number of ip6tables rules that currently use this configuration. */
+	unsigned int refcount;
+	/** What check_entry() leaves in the targinfos of @key's rules. */
+	struct xt_marksrcrange_tginfo cfg;
+
+	/* Precomputed for the index. */
+	struct in6_addr first;
+	struct in6_addr last;
+	__u32 mark_first;
+	__u32 mark_last;
+
+	struct hlist_node hash_hook;
+	/** Links this to its namespace's msr_net.rule_list. */
+	struct list_head list_hook;
+};
+
+/**
+ * A rule, indexed by the address range its --source spans.
+ */
+struct msr_src_node {
+	struct in6_addr first;
+	struct in6_addr last;
+	/**
+	 * Index of the nearest node whose range contains this one's,
+	 * or -1 if there is none.
+	 */
+	int parent;
+	struct xt_marksrcrange_tginfo cfg;
+};
+
+/**
+ * A rule, indexed by the mark range it assigns.
+ */
+struct msr_mark_node {
+	struct rb_node rb;
+	__u32 first;
+	__u32 last;
+	/** Highest @last in this node's subtree. (Maintained by mark_tree.) */
+	__u32 subtree_last;
+	struct xt_marksrcrange_tginfo cfg;
+};
+
+#define MARK_NODE_FIRST(node) ((node)->first)
+#define MARK_NODE_LAST(node) ((node)->last)
+INTERVAL_TREE_DEFINE(struct msr_mark_node, rb, __u32, subtree_last,
+		MARK_NODE_FIRST, MARK_NODE_LAST, static, mark_tree)
+
+/**
+ * The read-only snapshot of the registry the readers see.
+ *
+ * @srcs is sorted by @first, so source lookups start with a binary search.
+ * Because prefixes cannot partially overlap, @srcs is laminar; the most
+ * specific prefix that contains an address is always reachable by walking
+ * the @parent chain from the binary search's result.
+ *
+ * Mark ranges, on the other hand, are arbitrary, so @marks is an interval
+ * tree. It lives in @mark_nodes, and is never modified once published.
+ */
+struct msr_index {
+	unsigned int count;
+	struct msr_src_node *srcs;
+	struct msr_mark_node *mark_nodes;
+	MARK_TREE_ROOT marks;
+	struct rcu_head rcu;
+};
+
+/**
+ * A namespace's registry.
+ * Aside from the index, everything is protected by @registry_mutex.
+ */
+struct msr_net {
+	/** The namespace's msr_rules. (Also found in @rules.) */
+	struct list_head rule_list;
+	/** Length of @rule_list. (ie. distinct configurations.) */
+	unsigned int rule_count;
+	struct msr_index __rcu *current_index;
+	/** Bumped whenever @rule_list changes. */
+	unsigned long generation;
+	/** The @generation @current_index reflects. Only written by reindex(). */
+	unsigned long index_generation;
+	/** The namespace is being torn down; do not reindex anymore. */
+	bool dead;
+	struct delayed_work reindex_work;
+};
+
+static unsigned int msr_net_id __read_mostly;
+
+/*
+ * Every namespace's rules. (A table per namespace would cost 128 KB to every
+ * namespace, whether it uses MARKSRCRANGE or not.)
+ * 2^14 buckets keep the chains short even with 100k distinct rules.
+ */
+static DEFINE_HASHTABLE(rules, 14);
+static DEFINE_MUTEX(registry_mutex);
+
+/*
+ * How long changes are allowed to pile up before the index is rebuilt.
+ * (The lookups lag behind the rules for about this long.)
+ */
+#define REINDEX_DELAY msecs_to_jiffies(10)
+
+static struct msr_net *msr_pernet(struct net *net)
+{
+	return net_generic(net, msr_net_id);
+}
+
+/**
+ * Computes the first and last addresses of @prefix.
+ */
+static void prefix_bounds(const struct ipv6_prefix *prefix,
+		struct in6_addr *first, struct in6_addr *last)
+{
+	unsigned int i;
+	int bits;
+
+	ipv6_addr_prefix(first, &prefix->address, prefix->len);
+	*last = *first;
+	for (i = 0; i < 4; i++) {
+		bits = prefix->len - 32 * i;
+		if (bits <= 0)
+			last->s6_addr32[i] = cpu_to_be32(0xFFFFFFFFu);
+		else if (bits < 32)
+			last->s6_addr32[i] |= cpu_to_be32(0xFFFFFFFFu >> bits);
+	}
+}
+
+static int src_node_cmp(const void *a, const void *b)
+{
+	const struct msr_src_node *n1 = a;
+	const struct msr_src_node *n2 = b;
+	int gap;
+
+	gap = ipv6_addr_cmp(&n1->first, &n2->first);
+	if (gap)
+		return gap;
+	/* Same first address; the container goes first. */
+	return ((int)n1->cfg.prefix.len) - ((int)n2->cfg.prefix.len);
+}
+
+/**
+ * Copies @msr's rules into a new, unsorted index.
+ * Assumes @registry_mutex is held.
+ */
+static struct msr_index *build_index(struct msr_net *msr)
+{
+	struct msr_index *result;
+	struct msr_rule *rule;
+	struct msr_src_node *src;
+	struct msr_mark_node *mark;
+	unsigned int rule_count = msr->rule_count;
+	unsigned int count;
+
+	if (rule_count == 0)
+		return NULL;
+
+	result = vmalloc(sizeof(*result)
+			+ rule_count * sizeof(*result->srcs)
+			+ rule_count * sizeof(*result->mark_nodes));
+	if (!result)
+		return ERR_PTR(-ENOMEM);
+
+	result->srcs = (struct msr_src_node *)(result + 1);
+	result->mark_nodes = (struct msr_mark_node *)(result->srcs + rule_count);
+
+	count = 0;
+	src = result->srcs;
+	mark = result->mark_nodes;
+	list_for_each_entry(rule, &msr->rule_list, list_hook) {
+		if (rule->cfg.src_inverted)
+			continue;
+
+		src->first = rule->first;
+		src->last = rule->last;
+		src->cfg = rule->cfg;
+		src++;
+
+		mark->first = rule->mark_first;
+		mark->last = rule->mark_last;
+		mark->cfg = rule->cfg;
+		mark++;
+
+		count++;
+	}
+
+	if (count == 0) {
+		vfree(result);
+		return NULL;
+	}
+
+	result->count = count;
+	return result;
+}
+
+/**
+ * Sorts @idx and builds its trees.
+ * Does not need @registry_mutex; @idx is not shared yet.
+ */
+static void sort_index(struct msr_index *idx)
+{
+	struct msr_src_node *src = idx->srcs;
+	unsigned int i;
+	int p;
+
+	sort(src, idx->count, sizeof(*src), src_node_cmp, NULL);
+
+	for (i = 0; i < idx->count; i++) {
+		/*
+		 * The parent is either the left neighbor or one of its
+		 * ancestors. Each node is skipped at most once overall, so
+		 * this is linear.
+		 */
+		p = ((int)i) - 1;
+		while (p >= 0 && ipv6_addr_cmp(&src[p].last, &src[i].first) < 0)
+			p = src[p].parent;
+		src[i].parent = p;
+	}
+
+	idx->marks = MARK_TREE_EMPTY;
+	for (i = 0; i < idx->count; i++)
+		mark_tree_insert(&idx->mark_nodes[i], &idx->marks);
+}
+
+static void free_index_rcu(struct rcu_head *rcu)
+{
+	vfree(container_of(rcu, struct msr_index, rcu));
+}
+
+/**
+ * Replaces a namespace's index with one that reflects its current rules.
+ *
+ * Runs on the system workqueue, which never runs a work item concurrently with
+ * itself, so there is only ever one writer of @current_index. (Aside from
+ * msr_net_exit(), which cancels this first.)
+ */
+static void reindex(struct work_struct *work)
+{
+	struct msr_net *msr = container_of(to_delayed_work(work),
+			struct msr_net, reindex_work);
+	struct msr_index *new;
+	struct msr_index *old;
+	unsigned long gen;
+
+	mutex_lock(&registry_mutex);
+	gen = msr->generation;
+	new = build_index(msr);
+	mutex_unlock(&registry_mutex);
+
+	if (IS_ERR(new)) {
+		pr_warn("MARKSRCRANGE: Out of memory; the lookup index is stale. Retrying later.\n");
+		schedule_delayed_work(&msr->reindex_work, REINDEX_DELAY);
+		return;
+	}
+
+	/* The expensive part; do it without blocking rule changes. */
+	if (new)
+		sort_index(new);
+
+	old = rcu_dereference_protected(msr->current_index, true);
+	rcu_assign_pointer(msr->current_index, new);
+	if (old)
+		call_rcu(&old->rcu, free_index_rcu);
+
+	WRITE_ONCE(msr->index_generation, gen);
+}
+
+static void build_key(const struct in6_addr *src, const struct in6_addr *smsk,
+		bool src_inverted, const struct xt_marksrcrange_tginfo *info,
+		struct msr_key *key)
+{
+	key->src = *src;
+	key->smsk = *smsk;
+	key->mark_offset = info->mark_offset;
+	key->sub_prefix_len = info->sub_prefix_len;
+	key->verdict = info->verdict;
+	key->src_inverted = src_inverted;
+}
+
+static u32 hash_key(struct net *net, const struct msr_key *key)
+{
+	return jhash2((const u32 *)key, sizeof(*key) / sizeof(u32),
+			net_hash_mix(net));
+}
+
+/**
+ * Assumes @registry_mutex is held.
+ */
+static struct msr_rule *find_rule(struct net *net, const struct msr_key *key,
+		u32 hash)
+{
+	struct msr_rule *rule;
+
+	hash_for_each_possible(rules, rule, hash_hook, hash) {
+		if (rule->net == net && memcmp(&rule->key, key, sizeof(*key)) == 0)
+			return rule;
+	}
+
+	return NULL;
+}
+
+static int __net_init msr_net_init(struct net *net)
+{
+	struct msr_net *msr = msr_pernet(net);
+
+	INIT_LIST_HEAD(&msr->rule_list);
+	msr->rule_count = 0;
+	RCU_INIT_POINTER(msr->current_index, NULL);
+	msr->generation = 0;
+	msr->index_generation = 0;
+	msr->dead = false;
+	INIT_DELAYED_WORK(&msr->reindex_work, reindex);
+	return 0;
+}
+
+/**
+ * The namespace's tables might not have been torn down yet, so there might
+ * still be rules left. registry_rm() will come for them later; @msr itself
+ * is only freed once every pernet_operations' exit has run.
+ */
+static void __net_exit msr_net_exit(struct net *net)
+{
+	struct msr_net *msr = msr_pernet(net);
+	struct msr_index *old;
+
+	mutex_lock(&registry_mutex);
+	msr->dead = true;
+	mutex_unlock(&registry_mutex);
+
+	cancel_delayed_work_sync(&msr->reindex_work);
+
+	old = rcu_dereference_protected(msr->current_index, true);
+	RCU_INIT_POINTER(msr->current_index, NULL);
+	if (old)
+		call_rcu(&old->rcu, free_index_rcu);
+}
+
+static struct pernet_operations msr_net_ops = {
+	.init = msr_net_init,
+	.exit = msr_net_exit,
+	.id   = &msr_net_id,
+	.size = sizeof(struct msr_net),
+};
+
+int registry_init(void)
+{
+	return register_pernet_subsys(&msr_net_ops);
+}
+
+/**
+ * Assumes there are no rules left. (Which is the case when the module is
+ * being removed.)
+ */
+void registry_destroy(void)
+{
+	unregister_pernet_subsys(&msr_net_ops);
+	/* Wait for every pending free_index_rcu() before the code goes away. */
+	rcu_barrier();
+}
+
+/**
+ * check_entry(), except configurations that have already been validated are
+ * not validated again. Also makes the rule visible to the exported lookup
+ * functions.
+ */
+int registry_add(const struct xt_tgchk_param *param)
+{
+	struct ip6t_ip6 *entry = &((struct ip6t_entry *)param->entryinfo)->ipv6;
+	struct xt_marksrcrange_tginfo *info = param->targinfo;
+	struct msr_net *msr = msr_pernet(param->net);
+	struct msr_rule *rule;
+	struct msr_key key;
+	u32 hash;
+	int error = 0;
+
+	build_key(&entry->src, &entry->smsk,
+			!!(entry->invflags & IP6T_INV_SRCIP), info, &key);
+	hash = hash_key(param->net, &key);
+
+	mutex_lock(&registry_mutex);
+
+	rule = find_rule(param->net, &key, hash);
+	if (rule) {
+		/* See check_entry() for the reason why this is legal. */
+		*info = rule->cfg;
+		rule->refcount++;
+		goto end;
+	}
+
+	error = check_entry(param);
+	if (error)
+		goto end;
+
+	rule = kmalloc(sizeof(*rule), GFP_KERNEL);
+	if (!rule) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	rule->net = param->net;
+	rule->key = key;
+	rule->refcount = 1;
+	rule->cfg = *info;
+	prefix_bounds(&info->prefix, &rule->first, &rule->last);
+	rule->mark_first = info->mark_offset;
+	rule->mark_last = info->mark_offset + (__u32)((((__u64)1)
+			<< (info->sub_prefix_len - info->prefix.len)) - 1);
+
+	hash_add(rules, &rule->hash_hook, hash);
+	list_add_tail(&rule->list_hook, &msr->rule_list);
+	msr->rule_count++;
+	msr->generation++;
+	schedule_delayed_work(&msr->reindex_work, REINDEX_DELAY);
+
+end:
+	mutex_unlock(&registry_mutex);
+	return error;
+}
+
+/**
+ * Called when @info's rule is being destroyed. @net is the namespace whose
+ * table held it.
+ */
+void registry_rm(struct net *net, const struct xt_marksrcrange_tginfo *info)
+{
+	struct msr_net *msr = msr_pernet(net);
+	struct msr_rule *rule;
+	struct in6_addr smsk;
+	struct msr_key key;
+	u32 hash;
+
+	/* check_entry() made sure this is the mask the rule was created with. */
+	cidr_to_dot_decimal(info->prefix.len, &smsk);
+	build_key(&info->prefix.address, &smsk, info->src_inverted, info, &key);
+	hash = hash_key(net, &key);
+
+	mutex_lock(&registry_mutex);
+
+	rule = find_rule(net, &key, hash);
+	/* Either registry_add() never saw this rule, or the keys disagree. */
+	if (WARN_ON_ONCE(!rule))
+		goto end;
+
+	rule->refcount--;
+	if (rule->refcount == 0) {
+		hash_del(&rule->hash_hook);
+		list_del(&rule->list_hook);
+		msr->rule_count--;
+		msr->generation++;
+		kfree(rule);
+		if (!msr->dead)
+			schedule_delayed_work(&msr->reindex_work,
+					REINDEX_DELAY);
+	}
+
+end:
+	mutex_unlock(&registry_mutex);
+}
+
+/**
+ * Waits until @net's lookups reflect every rule change that finished before
+ * this call. (Otherwise, they might lag behind for up to REINDEX_DELAY.)
+ *
+ * Returns 0 on success, -ENOMEM if the index could not be rebuilt. (In which
+ * case the lookups stay stale until a later attempt succeeds; it is retried
+ * automatically, but you can also call this again.)
+ * Might sleep, so process context only.
+ */
+int marksrcrange_sync(struct net *net)
+{
+	struct msr_net *msr = msr_pernet(net);
+	unsigned long target;
+
+	mutex_lock(&registry_mutex);
+	target = msr->generation;
+	mutex_unlock(&registry_mutex);
+
+	/* Runs the pending rebuild now, if there is one. */
+	flush_delayed_work(&msr->reindex_work);
+
+	/* (Written like time_before(), so it survives wraparound.) */
+	return ((long)(READ_ONCE(msr->index_generation) - target) < 0)
+			? -ENOMEM : 0;
+}
+EXPORT_SYMBOL(marksrcrange_sync);
+
+/**
+ * Returns (in @mark) the mark @net's MARKSRCRANGE rules would assign to
+ * packets sourced from @src.
+ *
+ * If several rules span @src and they disagree on the mark, the one that
+ * prevails depends on the rules' order and verdicts (in CONTINUE mode the last
+ * matching rule wins; in ACCEPT mode, the first one does). This module cannot
+ * see the order, so it does not guess; it returns -EEXIST instead.
+ *
+ * Returns 0 on success, -ESRCH if no rule spans @src, -EEXIST if the rules
+ * that span @src are ambiguous.
+ * Safe to call from any context.
+ */
+int marksrcrange_src_to_mark(struct net *net, const struct in6_addr *src,
+		__u32 *mark)
+{
+	struct msr_index *idx;
+	struct msr_src_node *nodes;
+	unsigned int lo, hi, mid;
+	int i;
+	int error = -ESRCH;
+
+	rcu_read_lock();
+
+	idx = rcu_dereference(msr_pernet(net)->current_index);
+	if (!idx)
+		goto end;
+	nodes = idx->srcs;
+
+	/* Find the last node whose first address is <= @src. */
+	lo = 0;
+	hi = idx->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ipv6_addr_cmp(&nodes[mid].first, src) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Climb until we find a prefix that actually contains @src. */
+	i = ((int)lo) - 1;
+	while (i >= 0 && ipv6_addr_cmp(&nodes[i].last, src) < 0)
+		i = nodes[i].parent;
+	if (i < 0)
+		goto end;
+
+	*mark = src_to_mark(src, &nodes[i].cfg);
+	error = 0;
+
+	/*
+	 * Every other prefix that contains @src is an ancestor of @i.
+	 * (There are none in a configuration without overlapping rules.)
+	 */
+	for (i = nodes[i].parent; i >= 0; i = nodes[i].parent) {
+		if (src_to_mark(src, &nodes[i].cfg) != *mark) {
+			error = -EEXIST;
+			break;
+		}
+	}
+
+end:
+	rcu_read_unlock();
+	return error;
+}
+EXPORT_SYMBOL(marksrcrange_src_to_mark);
+
+/**
+ * Returns (in @prefix) the group of clients @net's MARKSRCRANGE rules assign
+ * @mark to. @prefix's length will be the rule's --sub-prefix-len.
+ *
+ * If several rules assign @mark to different clients, this returns -EEXIST.
+ * (See marksrcrange_src_to_mark().)
+ *
+ * Returns 0 on success, -ESRCH if no rule assigns @mark, -EEXIST if the rules
+ * that assign @mark are ambiguous.
+ * Safe to call from any context.
+ */
+int marksrcrange_mark_to_prefix(struct net *net, __u32 mark,
+		struct ipv6_prefix *prefix)
+{
+	struct msr_index *idx;
+	struct msr_mark_node *node;
+	struct ipv6_prefix other;
+	int error = -ESRCH;
+
+	rcu_read_lock();
+
+	idx = rcu_dereference(msr_pernet(net)->current_index);
+	if (!idx)
+		goto end;
+
+	node = mark_tree_iter_first(&idx->marks, mark, mark);
+	if (!node)
+		goto end;
+
+	mark_to_prefix(mark, &node->cfg, prefix);
+	error = 0;
+
+	/* (There are none in a configuration without overlapping rules.) */
+	while ((node = mark_tree_iter_next(node, mark, mark)) != NULL) {
+		mark_to_prefix(mark, &node->cfg, &other);
+		if (other.len != prefix->len
+				|| !ipv6_addr_equal(&other.address, &prefix->address)) {
+			error = -EEXIST;
+			break;
+		}
+	}
+
+end:
+	rcu_read_unlock();
+	return error;
+}
+EXPORT_SYMBOL(marksrcrange_mark_to_prefix);
@@ -0,0 +1,13 @@
+#ifndef SRC_MOD_REGISTRY_H_
+#define SRC_MOD_REGISTRY_H_
+
+#include <linux/netfilter/x_tables.h>
+#include "xt_MARKSRCRANGE.h"
+
+int registry_init(void);
+void registry_destroy(void);
+
+int registry_add(const struct xt_tgchk_param *param);
+void registry_rm(struct net *net, const struct xt_marksrcrange_tginfo *info);
+
+#endif /* SRC_MOD_REGISTRY_H_ */
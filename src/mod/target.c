@@ -32,11 +32,36 @@ static __u8 dot_decimal_to_cidr(struct in6_addr *mask)
 	return 128;
 }
 
+/**
+ * The inverse of dot_decimal_to_cidr(); returns (in @mask) the network mask
+ * whose prefix length is @len.
+ */
+void cidr_to_dot_decimal(__u8 len, struct in6_addr *mask)
+{
+	unsigned int i;
+	int bits;
+
+	for (i = 0; i < 4; i++) {
+		bits = len - 32 * i;
+		if (bits >= 32)
+			mask->s6_addr32[i] = cpu_to_be32(0xFFFFFFFFu);
+		else if (bits <= 0)
+			mask->s6_addr32[i] = 0;
+		else
+			mask->s6_addr32[i] = cpu_to_be32(0xFFFFFFFFu << (32 - bits));
+	}
+}
+
 static int validate(struct xt_marksrcrange_tginfo *info)
 {
 	__u64 client_count;
 	__u64 max_mark;
 
+	if (info->verdict > MSR_VERDICT_ACCEPT) {
+		pr_err("MARKSRCRANGE: Unknown verdict code: %u.\n", info->verdict);
+		return -EINVAL;
+	}
+
 	if (info->prefix.len > info->sub_prefix_len) {
 		pr_err("MARKSRCRANGE: sub-prefix-len is supposed to be longer or equal than --source's length.\n");
 		return -EINVAL;
@@ -65,6 +90,7 @@ int check_entry(const struct xt_tgchk_param *param)
 {
 	struct ip6t_ip6 *entry = &((struct ip6t_entry *)param->entryinfo)->ipv6;
 	struct xt_marksrcrange_tginfo *info = param->targinfo;
+	struct in6_addr mask;
 
 	/*
 	 * Yes, I'm editing @info. Even though it is pointed by an object that
@@ -86,6 +112,14 @@ int check_entry(const struct xt_tgchk_param *param)
 	 */
 	memcpy(&info->prefix, &entry->src, sizeof(entry->src));
 	info->prefix.len = dot_decimal_to_cidr(&entry->smsk);
+	info->src_inverted = !!(entry->invflags & IP6T_INV_SRCIP);
+
+	/* The registry needs to be able to rebuild @smsk from @info. */
+	cidr_to_dot_decimal(info->prefix.len, &mask);
+	if (!ipv6_addr_equal(&mask, &entry->smsk)) {
+		pr_err("MARKSRCRANGE: --source's mask is supposed to be a CIDR mask.\n");
+		return -EINVAL;
+	}
 
 	return validate(info);
 }
@@ -104,6 +138,13 @@ static __u32 extract_bits(const struct in6_addr *addr,
 {
 	__u32 result;
 
+	/*
+	 * Zero bits. (The masks below cannot express this when @from is
+	 * aligned to a quadrant.)
+	 */
+	if (from == to)
+		return 0;
+
 	/*
 	 * Remember: "& 0x1F" is a faster way of saying "% 32"
 	 * and ">> 5" is a faster way of saying "/ 32".
@@ -140,6 +181,42 @@ __u32 src_to_mark(const struct in6_addr *src,
 			cfg->sub_prefix_len);
 }
 
+static void put_bits(struct in6_addr *addr, const __u8 from, const __u8 to,
+		__u32 bits)
+{
+	__be32 *quad;
+	__u32 mask;
+	unsigned int i;
+
+	/* Fill from the right; @bits' least significant bit goes to @to - 1. */
+	for (i = to; i > from; i--) {
+		quad = &addr->s6_addr32[(i - 1) >> 5];
+		mask = 1U << (31 - ((i - 1) & 0x1F));
+		if (bits & 1)
+			*quad |= cpu_to_be32(mask);
+		else
+			*quad &= cpu_to_be32(~mask);
+		bits >>= 1;
+	}
+}
+
+/**
+ * The inverse of src_to_mark(); returns (in @result) the sub-prefix whose
+ * clients the @cfg configuration marks as @mark.
+ *
+ * Assumes @mark is one of the marks @cfg assigns.
+ */
+void mark_to_prefix(const __u32 mark,
+		const struct xt_marksrcrange_tginfo *cfg,
+		struct ipv6_prefix *result)
+{
+	ipv6_addr_prefix(&result->address, &cfg->prefix.address,
+			cfg->sub_prefix_len);
+	put_bits(&result->address, cfg->prefix.len, cfg->sub_prefix_len,
+			mark - cfg->mark_offset);
+	result->len = cfg->sub_prefix_len;
+}
+
 /**
  * Called on every matched packet; marks the packet depending on its source
  * address.
@@ -147,11 +224,75 @@ __u32 src_to_mark(const struct in6_addr *src,
 unsigned int change_mark(struct sk_buff *skb,
 		const struct xt_action_param *param)
 {
+	const struct xt_marksrcrange_tginfo *info = param->targinfo;
 	struct in6_addr *src = &ipv6_hdr(skb)->saddr;
 
-	skb->mark = src_to_mark(src, param->targinfo);
-	pr_debug("MARKSRCRANGE: Packet from %pI6c was marked %u.\n",
+	if (info->verdict == MSR_VERDICT_CONTINUE) {
+		skb->mark = src_to_mark(src, info);
+		pr_debug("MARKSRCRANGE: Packet from %pI6c was marked %u.\n",
+				src, skb->mark);
+		return XT_CONTINUE;
+	}
+
+	/*
+	 * We're about to end the table walk, so we'd better be sure the packet
+	 * really belongs to us. (eg. The rule might be using "! --source".)
+	 */
+	if (!ipv6_prefix_equal(src, &info->prefix.address, info->prefix.len)) {
+		pr_debug("MARKSRCRANGE: Packet from %pI6c is not mine.\n", src);
+		return XT_CONTINUE;
+	}
+
+	skb->mark = src_to_mark(src, info);
+	pr_debug("MARKSRCRANGE: Packet from %pI6c was marked %u (accepted).\n",
 			src, skb->mark);
+	return NF_ACCEPT;
+}
 
+/**
+ * Returns (in @cfg) the revision 1 equivalent of @info.
+ */
+static void v0_to_v1(const struct xt_marksrcrange_tginfo_v0 *info,
+		struct xt_marksrcrange_tginfo *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->mark_offset = info->mark_offset;
+	cfg->prefix = info->prefix;
+	cfg->sub_prefix_len = info->sub_prefix_len;
+	cfg->verdict = MSR_VERDICT_CONTINUE;
+}
+
+/**
+ * check_entry(), for revision 0 rules.
+ */
+int check_entry_v0(const struct xt_tgchk_param *param)
+{
+	struct xt_marksrcrange_tginfo_v0 *info = param->targinfo;
+	struct xt_tgchk_param param1 = *param;
+	struct xt_marksrcrange_tginfo cfg;
+	int error;
+
+	v0_to_v1(info, &cfg);
+	param1.targinfo = &cfg;
+
+	error = check_entry(&param1);
+	if (!error)
+		info->prefix = cfg.prefix; /* See check_entry(). */
+	return error;
+}
+
+/**
+ * change_mark(), for revision 0 rules. (Which always CONTINUE.)
+ */
+unsigned int change_mark_v0(struct sk_buff *skb,
+		const struct xt_action_param *param)
+{
+	struct xt_marksrcrange_tginfo cfg;
+	struct in6_addr *src = &ipv6_hdr(skb)->saddr;
+
+	v0_to_v1(param->targinfo, &cfg);
+	skb->mark = src_to_mark(src, &cfg);
+	pr_debug("MARKSRCRANGE: Packet from %pI6c was marked %u.\n",
+			src, skb->mark);
 	return XT_CONTINUE;
 }
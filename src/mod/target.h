@@ -4,11 +4,18 @@
 #include <linux/netfilter/x_tables.h>
 #include "xt_MARKSRCRANGE.h"
 
+void cidr_to_dot_decimal(__u8 len, struct in6_addr *mask);
 int check_entry(const struct xt_tgchk_param *param);
 unsigned int change_mark(struct sk_buff *skb,
 		const struct xt_action_param *param);
+int check_entry_v0(const struct xt_tgchk_param *param);
+unsigned int change_mark_v0(struct sk_buff *skb,
+		const struct xt_action_param *param);
 
 __u32 src_to_mark(const struct in6_addr *src,
 		const struct xt_marksrcrange_tginfo *cfg);
+void mark_to_prefix(const __u32 mark,
+		const struct xt_marksrcrange_tginfo *cfg,
+		struct ipv6_prefix *result);
 
 #endif /* SRC_MOD_TARGET_H_ */
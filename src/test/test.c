@@ -140,9 +140,114 @@ int str_to_prefix6(const char *str, struct ipv6_prefix *prefix_out)
 	return str_to_u8(token, &prefix_out->len, 0, 128); /* Error msg already printed. */
 }
 
+enum batch_type {
+	BATCH_NONE,
+	/* `ip -6 -batch` policy routing rules. */
+	BATCH_IP,
+	/* `tc -batch` fw filters. */
+	BATCH_TC,
+};
+
+struct batch_args {
+	enum batch_type type;
+	/* ip only. */
+	char *table;
+	/* tc only. */
+	char *dev;
+	char *parent;
+	char *classid;
+	/* Both. Zero means "let the tool decide" (ip only). */
+	__u32 priority;
+};
+
+/**
+ * Returns the value of the argv[@i] option, or NULL (and complains) if the
+ * command line ends before it.
+ */
+static char *get_value(int argc, char *argv[], unsigned int i)
+{
+	if (i + 1 >= argc) {
+		printf("%s requires an argument.\n", argv[i]);
+		return NULL;
+	}
+	return argv[i + 1];
+}
+
+static int parse_batch_args(int argc, char *argv[], struct batch_args *batch)
+{
+	unsigned int i;
+	char *value;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->parent = "1:";
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--batch") == 0) {
+			value = get_value(argc, argv, i);
+			if (!value)
+				return 1;
+			if (strcmp(value, "ip") == 0) {
+				batch->type = BATCH_IP;
+			} else if (strcmp(value, "tc") == 0) {
+				batch->type = BATCH_TC;
+			} else {
+				printf("--batch expects 'ip' or 'tc'.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--table") == 0) {
+			batch->table = get_value(argc, argv, i);
+			if (!batch->table)
+				return 1;
+		} else if (strcmp(argv[i], "--dev") == 0) {
+			batch->dev = get_value(argc, argv, i);
+			if (!batch->dev)
+				return 1;
+		} else if (strcmp(argv[i], "--parent") == 0) {
+			batch->parent = get_value(argc, argv, i);
+			if (!batch->parent)
+				return 1;
+		} else if (strcmp(argv[i], "--classid") == 0) {
+			batch->classid = get_value(argc, argv, i);
+			if (!batch->classid)
+				return 1;
+		} else if (strcmp(argv[i], "--priority") == 0) {
+			value = get_value(argc, argv, i);
+			if (!value || str_to_u32(value, &batch->priority, 0, 0xFFFFu))
+				return 1;
+		}
+	}
+
+	switch (batch->type) {
+	case BATCH_NONE:
+		break;
+	case BATCH_IP:
+		if (!batch->table) {
+			printf("--batch ip requires --table.\n");
+			return 1;
+		}
+		break;
+	case BATCH_TC:
+		if (!batch->dev || !batch->classid) {
+			printf("--batch tc requires --dev and --classid.\n");
+			return 1;
+		}
+		/* tc wants one priority per mask; they're 33 at most. */
+		if (batch->priority == 0)
+			batch->priority = 1;
+		if (batch->priority > 0xFFFFu - 32) {
+			printf("--priority is too high; tc needs room for 33 priorities.\n");
+			return 1;
+		}
+		break;
+	}
+
+	return 0;
+}
+
 static int parse_args(int argc, char *argv[], struct xt_marksrcrange_tginfo *info)
 {
 	unsigned int i;
+	char *value;
 	bool source_set = false;
 
 	memset(info, 0, sizeof(*info));
@@ -150,14 +255,17 @@ static int parse_args(int argc, char *argv[], struct xt_marksrcrange_tginfo *inf
 
 	for (i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--source") == 0) {
-			if (str_to_prefix6(argv[i + 1], &info->prefix))
+			value = get_value(argc, argv, i);
+			if (!value || str_to_prefix6(value, &info->prefix))
 				return 1;
 			source_set = 1;
 		} else if (strcmp(argv[i], "--mark-offset") == 0) {
-			if (str_to_u32(argv[i + 1], &info->mark_offset, 0, 0xFFFFFFFFu))
+			value = get_value(argc, argv, i);
+			if (!value || str_to_u32(value, &info->mark_offset, 0, 0xFFFFFFFFu))
 				return 1;
 		} else if (strcmp(argv[i], "--sub-prefix-len") == 0) {
-			if (str_to_u8(argv[i + 1], &info->sub_prefix_len, 0, 128))
+			value = get_value(argc, argv, i);
+			if (!value || str_to_u8(value, &info->sub_prefix_len, 0, 128))
 				return 1;
 		}
 	}
@@ -167,11 +275,21 @@ static int parse_args(int argc, char *argv[], struct xt_marksrcrange_tginfo *inf
 		return 1;
 	}
 
+	if (info->prefix.len > info->sub_prefix_len) {
+		printf("--sub-prefix-len cannot be shorter than --source's length.\n");
+		return 1;
+	}
+
 	if (info->sub_prefix_len - info->prefix.len > 32) {
 		printf("Too many addresses! There are only 2^32 marks.\n");
 		return 1;
 	}
 
+	if (info->mark_offset + (((__u64)1) << (info->sub_prefix_len - info->prefix.len)) - 1 > 0xFFFFFFFFu) {
+		printf("Too many marks for this --mark-offset. There are only 2^32 marks.\n");
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -225,15 +343,81 @@ static void print_combinations(struct xt_marksrcrange_tginfo *info)
 	}
 }
 
+static void print_fwmark(struct batch_args *batch, __u32 value,
+		unsigned int host_bits)
+{
+	__u32 mask = (host_bits == 32) ? 0 : (0xFFFFFFFFu << host_bits);
+
+	switch (batch->type) {
+	case BATCH_IP:
+		printf("rule add fwmark 0x%x/0x%x lookup %s",
+				value, mask, batch->table);
+		if (batch->priority)
+			printf(" priority %u", batch->priority);
+		printf("\n");
+		break;
+	case BATCH_TC:
+		printf("filter add dev %s parent %s protocol ipv6 prio %u handle 0x%x/0x%x fw classid %s\n",
+				batch->dev, batch->parent,
+				batch->priority + host_bits,
+				value, mask, batch->classid);
+		break;
+	case BATCH_NONE:
+		break;
+	}
+}
+
+/**
+ * Prints the rule's mark range as the minimal set of "value/mask" pairs.
+ *
+ * Every pair is the largest aligned power-of-two block that starts at the
+ * first mark not yet covered and does not overflow the range. (A range of 2^n
+ * marks never needs more than 2n pairs.)
+ */
+static void print_fwmarks(struct xt_marksrcrange_tginfo *info,
+		struct batch_args *batch)
+{
+	__u64 first;
+	__u64 last;
+	unsigned int host_bits;
+
+	first = info->mark_offset;
+	last = first + (((__u64)1) << (info->sub_prefix_len - info->prefix.len)) - 1;
+
+	while (first <= last) {
+		for (host_bits = 32; host_bits > 0; host_bits--) {
+			if ((first & ((((__u64)1) << host_bits) - 1)) == 0
+					&& first + (((__u64)1) << host_bits) - 1 <= last)
+				break;
+		}
+
+		print_fwmark(batch, first, host_bits);
+		first += ((__u64)1) << host_bits;
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct xt_marksrcrange_tginfo info;
+	struct batch_args batch;
 	int error;
 
 	error = parse_args(argc, argv, &info);
 	if (error)
 		return error;
+	error = parse_batch_args(argc, argv, &batch);
+	if (error)
+		return error;
+
+	/* cls_fw refuses handle 0, and the first pair would start there. */
+	if (batch.type == BATCH_TC && info.mark_offset == 0) {
+		printf("tc's fw filters cannot match mark 0; please use a nonzero --mark-offset.\n");
+		return 1;
+	}
 
-	print_combinations(&info);
+	if (batch.type == BATCH_NONE)
+		print_combinations(&info);
+	else
+		print_fwmarks(&info, &batch);
 	return 0;
 }
@@ -0,0 +1,549 @@
+#include "registry_unit.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/inet.h>
+
+/*
+ * The registry is included (rather than linked) so msr_unit gets its own
+ * private copy of it, which exports nothing. (Otherwise it would clash with
+ * xt_MARKSRCRANGE's exports whenever both are loaded.)
+ */
+#undef EXPORT_SYMBOL
+#define EXPORT_SYMBOL(sym)
+#include "mod/registry.c"
+
+static unsigned int yays = 0;
+static unsigned int nays = 0;
+
+/**
+ * A fake ip6tables rule.
+ */
+struct test_rule {
+	/* Whether the registry accepted it. */
+	bool added;
+	struct xt_marksrcrange_tginfo info;
+	/* Last, because it ends in a flexible array. */
+	struct ip6t_entry entry;
+};
+
+/**
+ * Feeds "[!] --source @src_str/@plen -j MARKSRCRANGE --mark-offset @offset
+ * --sub-prefix-len @splen --verdict @verdict" to the registry.
+ */
+static bool add_rule(struct test_rule *rule, char *src_str, __u8 plen,
+		__u8 splen, __u32 offset, __u8 verdict, bool inverted)
+{
+	struct xt_tgchk_param param;
+	int error;
+
+	memset(rule, 0, sizeof(*rule));
+	if (!in6_pton(src_str, -1, (u8 *) &rule->entry.ipv6.src, '\0', NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", src_str);
+		nays++;
+		return false;
+	}
+	cidr_to_dot_decimal(plen, &rule->entry.ipv6.smsk);
+	if (inverted)
+		rule->entry.ipv6.invflags = IP6T_INV_SRCIP;
+	rule->info.mark_offset = offset;
+	rule->info.sub_prefix_len = splen;
+	rule->info.verdict = verdict;
+
+	memset(&param, 0, sizeof(param));
+	param.net = &init_net;
+	param.entryinfo = &rule->entry;
+	param.targinfo = &rule->info;
+
+	error = registry_add(&param);
+	if (error) {
+		pr_err("Adding rule %s/%u failed: %d.\n", src_str, plen, error);
+		nays++;
+		return false;
+	}
+
+	rule->added = true;
+	return true;
+}
+
+/**
+ * Makes sure the lookups see the latest rules.
+ */
+static bool sync_rules(void)
+{
+	int error;
+
+	error = marksrcrange_sync(&init_net);
+	if (error) {
+		pr_err("marksrcrange_sync() failed: %d.\n", error);
+		nays++;
+		return false;
+	}
+
+	return true;
+}
+
+static void rm_rules(struct test_rule *rules, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (rules[i].added)
+			registry_rm(&init_net, &rules[i].info);
+	sync_rules();
+}
+
+/**
+ * Asserts marksrcrange_src_to_mark(@src_str) returns @error and @expected.
+ */
+static bool test_src(char *src_str, int error, __u32 expected)
+{
+	struct in6_addr src;
+	__u32 actual;
+	int actual_error;
+
+	if (!in6_pton(src_str, -1, (u8 *) &src, '\0', NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", src_str);
+		nays++;
+		return false;
+	}
+
+	actual_error = marksrcrange_src_to_mark(&init_net, &src, &actual);
+	if (actual_error != error || (!error && actual != expected)) {
+		pr_err("Test #%u failed: %s: Expected %d/%u, got %d/%u.\n",
+				yays + nays, src_str, error, expected,
+				actual_error, actual_error ? 0 : actual);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+/**
+ * Asserts marksrcrange_mark_to_prefix(@mark) returns @error and
+ * @expected_str/@expected_len.
+ */
+static bool test_mark(__u32 mark, int error, char *expected_str,
+		__u8 expected_len)
+{
+	struct in6_addr expected;
+	struct ipv6_prefix actual;
+	int actual_error;
+
+	memset(&expected, 0, sizeof(expected));
+	if (expected_str && !in6_pton(expected_str, -1, (u8 *) &expected, '\0',
+			NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", expected_str);
+		nays++;
+		return false;
+	}
+
+	actual_error = marksrcrange_mark_to_prefix(&init_net, mark, &actual);
+	if (actual_error != error || (!error && (actual.len != expected_len
+			|| !ipv6_addr_equal(&actual.address, &expected)))) {
+		pr_err("Test #%u failed: %u: Expected %d/%pI6c/%u, got %d/%pI6c/%u.\n",
+				yays + nays, mark, error, &expected,
+				expected_len, actual_error, &actual.address,
+				actual.len);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+/**
+ * Asserts init_net's registry currently holds @expected distinct configurations.
+ */
+static bool test_rule_count(unsigned int expected)
+{
+	unsigned int actual = msr_pernet(&init_net)->rule_count;
+
+	if (actual != expected) {
+		pr_err("Test #%u failed: Expected %u configurations, got %u.\n",
+				yays + nays, expected, actual);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+/**
+ * Asserts registry_add() left the same targinfo in @rule as a plain
+ * check_entry() would have.
+ */
+static bool test_info(struct test_rule *rule)
+{
+	struct test_rule expected;
+	struct xt_tgchk_param param;
+	struct xt_marksrcrange_tginfo *actual = &rule->info;
+
+	memcpy(&expected, rule, sizeof(expected));
+	/* (Userspace only fills these.) */
+	memset(&expected.info, 0, sizeof(expected.info));
+	expected.info.mark_offset = actual->mark_offset;
+	expected.info.sub_prefix_len = actual->sub_prefix_len;
+	expected.info.verdict = actual->verdict;
+
+	memset(&param, 0, sizeof(param));
+	param.entryinfo = &expected.entry;
+	param.targinfo = &expected.info;
+	if (check_entry(&param)) {
+		pr_err("Test #%u failed: check_entry() rejected the rule.\n",
+				yays + nays);
+		nays++;
+		return false;
+	}
+
+	if (!ipv6_addr_equal(&actual->prefix.address,
+			&expected.info.prefix.address)
+			|| actual->prefix.len != expected.info.prefix.len
+			|| actual->src_inverted != expected.info.src_inverted) {
+		pr_err("Test #%u failed: Expected %pI6c/%u (%u), got %pI6c/%u (%u).\n",
+				yays + nays, &expected.info.prefix.address,
+				expected.info.prefix.len,
+				expected.info.src_inverted,
+				&actual->prefix.address, actual->prefix.len,
+				actual->src_inverted);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+static bool test_empty(void)
+{
+	bool success = true;
+
+	success &= test_src("2001:db8::1", -ESRCH, 0);
+	success &= test_mark(0, -ESRCH, NULL, 0);
+
+	return success;
+}
+
+static bool test_disjoint(void)
+{
+	struct test_rule rules[3];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8:1::", 120, 128, 0, 0, false);
+	success &= add_rule(&rules[1], "2001:db8:2::", 120, 128, 256, 0, false);
+	success &= add_rule(&rules[2], "2001:db8:3::", 112, 120, 512, 0, false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8:1::5", 0, 5);
+	success &= test_src("2001:db8:2::ff", 0, 511);
+	success &= test_src("2001:db8:3::102", 0, 513);
+	success &= test_src("2001:db8:1::1:0", -ESRCH, 0);
+	success &= test_src("2001:db8:4::1", -ESRCH, 0);
+	success &= test_src("2001:db8::", -ESRCH, 0);
+
+	success &= test_mark(5, 0, "2001:db8:1::5", 128);
+	success &= test_mark(300, 0, "2001:db8:2::2c", 128);
+	success &= test_mark(513, 0, "2001:db8:3::100", 120);
+	success &= test_mark(768, -ESRCH, NULL, 0);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Nested prefixes that agree on the mark. Exercises the climbing.
+ */
+static bool test_nested(void)
+{
+	struct test_rule rules[5];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8::", 32, 32, 7, 0, false);
+	success &= add_rule(&rules[1], "2001:db8:1::", 48, 48, 7, 0, false);
+	success &= add_rule(&rules[2], "2001:db8:1:1::", 64, 64, 7, 0, false);
+	success &= add_rule(&rules[3], "2001:db8:1:2::", 64, 64, 7, 0, false);
+	success &= add_rule(&rules[4], "2001:db8:3::", 48, 48, 7, 0, false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8:1:2::1", 0, 7);
+	success &= test_src("2001:db8:1:3::1", 0, 7);
+	success &= test_src("2001:db8:2::1", 0, 7);
+	success &= test_src("2001:db8:4::1", 0, 7);
+	success &= test_src("2001:db8::", 0, 7);
+	success &= test_src("2001:db8:ffff:ffff:ffff:ffff:ffff:ffff", 0, 7);
+	success &= test_src("2001:db7:ffff::", -ESRCH, 0);
+	success &= test_src("2001:db9::", -ESRCH, 0);
+
+	/* Same mark, different prefixes. */
+	success &= test_mark(7, -EEXIST, NULL, 0);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Nested prefixes that disagree on the mark.
+ */
+static bool test_ambiguous(void)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8::", 32, 48, 0, 0, false);
+	success &= add_rule(&rules[1], "2001:db8:5::", 48, 56, 100000, 0,
+			false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8:5:1200::1", -EEXIST, 0);
+	success &= test_src("2001:db8:6::1", 0, 6);
+	success &= test_mark(6, 0, "2001:db8:6::", 48);
+	success &= test_mark(100018, 0, "2001:db8:5:1200::", 56);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Same prefix and marks, different configurations.
+ */
+static bool test_duplicate(void)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8:7::", 120, 128, 1000,
+			MSR_VERDICT_CONTINUE, false);
+	success &= add_rule(&rules[1], "2001:db8:7::", 120, 128, 1000,
+			MSR_VERDICT_ACCEPT, false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8:7::3", 0, 1003);
+	success &= test_mark(1003, 0, "2001:db8:7::3", 128);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Disjoint prefixes, overlapping mark ranges.
+ */
+static bool test_overlapping_marks(void)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8:8::", 120, 128, 2000, 0,
+			false);
+	success &= add_rule(&rules[1], "2001:db8:9::", 120, 128, 2100, 0,
+			false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_mark(1999, -ESRCH, NULL, 0);
+	success &= test_mark(2050, 0, "2001:db8:8::32", 128);
+	success &= test_mark(2150, -EEXIST, NULL, 0);
+	success &= test_mark(2300, 0, "2001:db8:9::c8", 128);
+	success &= test_mark(2356, -ESRCH, NULL, 0);
+	success &= test_src("2001:db8:8::ff", 0, 2255);
+	success &= test_src("2001:db8:9::0", 0, 2100);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * One range that spans every mark.
+ */
+static bool test_wide(void)
+{
+	struct test_rule rules[1];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "::", 0, 32, 0, 0, false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8::1", 0, 0x20010db8);
+	success &= test_mark(0x20010db8, 0, "2001:db8::", 32);
+	success &= test_mark(0xffffffff, 0, "ffff:ffff::", 32);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * "! --source" rules must not be indexed.
+ */
+static bool test_inverted(void)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8:a::", 120, 128, 3000, 0, true);
+	success &= add_rule(&rules[1], "2001:db8:b::", 120, 128, 4000, 0,
+			false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_src("2001:db8:a::1", -ESRCH, 0);
+	success &= test_src("2001:db8:b::1", 0, 4001);
+	success &= test_mark(3001, -ESRCH, NULL, 0);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Identical rules share their configuration, and it has to outlive all but the
+ * last of them. (Which also proves registry_rm() finds what registry_add()
+ * stored.)
+ */
+static bool test_refcount_one(char *src_str, __u8 plen, __u8 splen,
+		__u32 offset, __u8 verdict, bool inverted, char *member_str,
+		__u32 expected)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], src_str, plen, splen, offset, verdict,
+			inverted);
+	success &= add_rule(&rules[1], src_str, plen, splen, offset, verdict,
+			inverted);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_rule_count(1);
+	/* The second one was a hash hit. */
+	success &= test_info(&rules[0]);
+	success &= test_info(&rules[1]);
+
+	registry_rm(&init_net, &rules[0].info);
+	rules[0].added = false;
+	success &= sync_rules();
+	success &= test_rule_count(1);
+	success &= test_src(member_str, inverted ? -ESRCH : 0, expected);
+
+	registry_rm(&init_net, &rules[1].info);
+	rules[1].added = false;
+	success &= sync_rules();
+	success &= test_rule_count(0);
+	success &= test_src(member_str, -ESRCH, 0);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+/*
+ * Rules that only differ in their verdict do not share their configuration.
+ */
+static bool test_refcount_distinct(void)
+{
+	struct test_rule rules[2];
+	bool success = true;
+
+	success &= add_rule(&rules[0], "2001:db8:e::", 120, 128, 8000,
+			MSR_VERDICT_CONTINUE, false);
+	success &= add_rule(&rules[1], "2001:db8:e::", 120, 128, 8000,
+			MSR_VERDICT_ACCEPT, false);
+	success &= sync_rules();
+	if (!success)
+		goto end;
+
+	success &= test_rule_count(2);
+
+	registry_rm(&init_net, &rules[0].info);
+	rules[0].added = false;
+	success &= sync_rules();
+	success &= test_rule_count(1);
+	success &= test_src("2001:db8:e::7", 0, 8007);
+
+	registry_rm(&init_net, &rules[1].info);
+	rules[1].added = false;
+	success &= sync_rules();
+	success &= test_rule_count(0);
+	success &= test_src("2001:db8:e::7", -ESRCH, 0);
+
+end:
+	rm_rules(rules, ARRAY_SIZE(rules));
+	return success;
+}
+
+static bool test_refcount(void)
+{
+	bool success = true;
+
+	success &= test_refcount_one("2001:db8:c::", 120, 128, 5000,
+			MSR_VERDICT_CONTINUE, false, "2001:db8:c::7", 5007);
+	success &= test_refcount_one("2001:db8:c::", 120, 128, 5000,
+			MSR_VERDICT_ACCEPT, false, "2001:db8:c::7", 5007);
+	success &= test_refcount_one("2001:db8:c::", 120, 128, 5000,
+			MSR_VERDICT_CONTINUE, true, "2001:db8:c::7", 0);
+	success &= test_refcount_one("2001:db8:c:c::", 63, 80, 0,
+			MSR_VERDICT_CONTINUE, false, "2001:db8:c:d:1234::", 0x11234);
+	success &= test_refcount_one("::", 0, 0, 6000,
+			MSR_VERDICT_CONTINUE, false, "2001:db8::1", 6000);
+	success &= test_refcount_one("2001:db8::1", 128, 128, 7000,
+			MSR_VERDICT_ACCEPT, false, "2001:db8::1", 7000);
+	success &= test_refcount_distinct();
+
+	return success;
+}
+
+/**
+ * Runs the registry tests, and adds their results to @total_yays and
+ * @total_nays.
+ */
+bool test_registry(unsigned int *total_yays, unsigned int *total_nays)
+{
+	bool success = true;
+	int error;
+
+	error = registry_init();
+	if (error) {
+		pr_err("registry_init() failed: %d.\n", error);
+		(*total_nays)++;
+		return false;
+	}
+
+	success &= test_empty();
+	success &= test_disjoint();
+	success &= test_nested();
+	success &= test_ambiguous();
+	success &= test_duplicate();
+	success &= test_overlapping_marks();
+	success &= test_wide();
+	success &= test_inverted();
+	success &= test_refcount();
+	/* Everything should be gone by now. */
+	success &= test_empty();
+
+	registry_destroy();
+
+	*total_yays += yays;
+	*total_nays += nays;
+	return success;
+}
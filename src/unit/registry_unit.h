@@ -0,0 +1,8 @@
+#ifndef SRC_UNIT_REGISTRY_UNIT_H_
+#define SRC_UNIT_REGISTRY_UNIT_H_
+
+#include <linux/types.h>
+
+bool test_registry(unsigned int *total_yays, unsigned int *total_nays);
+
+#endif /* SRC_UNIT_REGISTRY_UNIT_H_ */
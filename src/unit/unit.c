@@ -1,7 +1,10 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/inet.h>
-#include "xt_MARKSRCRANGE.h"
+#include <linux/skbuff.h>
+#include <net/ipv6.h>
+#include "mod/target.h"
+#include "registry_unit.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alberto Leiva <ydahhrk@gmail.com>");
@@ -44,9 +47,171 @@ static bool test(char *src_str, __u8 plen, __u8 splen, __u32 offset,
 	return true;
 }
 
+/**
+ * Asserts mark_to_prefix(@mark, @prefix_str/@plen, @splen, @offset) ==
+ * @expected_str/@splen.
+ */
+static bool test_reverse(char *prefix_str, __u8 plen, __u8 splen,
+		__u32 offset, __u32 mark, char *expected_str)
+{
+	struct in6_addr expected;
+	struct xt_marksrcrange_tginfo cfg;
+	struct ipv6_prefix actual;
+
+	if (!in6_pton(prefix_str, -1, (u8 *) &cfg.prefix.address, '\0', NULL)
+			|| !in6_pton(expected_str, -1, (u8 *) &expected, '\0',
+					NULL)) {
+		pr_err("Test #%u has a malformed address.\n", yays + nays);
+		nays++;
+		return false;
+	}
+	cfg.prefix.len = plen;
+	cfg.mark_offset = offset;
+	cfg.sub_prefix_len = splen;
+
+	mark_to_prefix(mark, &cfg, &actual);
+	if (memcmp(&actual.address, &expected, sizeof(expected))
+			|| actual.len != splen) {
+		pr_err("Test #%u failed: Expected %pI6c/%u, got %pI6c/%u.\n",
+				yays + nays, &expected, splen,
+				&actual.address, actual.len);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+/**
+ * Returns a packet sourced from @src_str, marked 0xdeadbeef.
+ */
+static struct sk_buff *create_skb(char *src_str)
+{
+	struct sk_buff *skb;
+	struct ipv6hdr *hdr;
+
+	skb = alloc_skb(sizeof(*hdr), GFP_KERNEL);
+	if (!skb) {
+		pr_err("Could not allocate a test packet.\n");
+		return NULL;
+	}
+	skb_reset_network_header(skb);
+	hdr = (struct ipv6hdr *)skb_put(skb, sizeof(*hdr));
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = 6;
+	if (!in6_pton(src_str, -1, (u8 *) &hdr->saddr, '\0', NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", src_str);
+		kfree_skb(skb);
+		return NULL;
+	}
+	skb->mark = 0xdeadbeef;
+
+	return skb;
+}
+
+/**
+ * Asserts @skb (sourced from @src_str) went through a rule that returned
+ * @actual, and frees it.
+ */
+static bool test_verdict(char *src_str, struct sk_buff *skb,
+		unsigned int actual, unsigned int expected_verdict,
+		__u32 expected_mark)
+{
+	__u32 actual_mark = skb->mark;
+
+	kfree_skb(skb);
+
+	if (actual != expected_verdict || actual_mark != expected_mark) {
+		pr_err("Test #%u failed: %s: Expected verdict %u, mark %u; got %u, %u.\n",
+				yays + nays, src_str, expected_verdict,
+				expected_mark, actual, actual_mark);
+		nays++;
+		return false;
+	}
+
+	yays++;
+	return true;
+}
+
+/**
+ * Sends a packet from @src_str through a "--source @prefix_str/@plen -j
+ * MARKSRCRANGE --sub-prefix-len @splen --mark-offset @offset --verdict
+ * @verdict" rule, and asserts the rule returns @expected_verdict and leaves
+ * the packet marked @expected_mark.
+ * The packet arrives marked 0xdeadbeef.
+ */
+static bool test_change_mark(char *src_str, char *prefix_str, __u8 plen,
+		__u8 splen, __u32 offset, __u8 verdict,
+		unsigned int expected_verdict, __u32 expected_mark)
+{
+	struct xt_marksrcrange_tginfo cfg;
+	struct xt_action_param param;
+	struct sk_buff *skb;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (!in6_pton(prefix_str, -1, (u8 *) &cfg.prefix.address, '\0', NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", prefix_str);
+		nays++;
+		return false;
+	}
+	cfg.prefix.len = plen;
+	cfg.mark_offset = offset;
+	cfg.sub_prefix_len = splen;
+	cfg.verdict = verdict;
+
+	skb = create_skb(src_str);
+	if (!skb) {
+		nays++;
+		return false;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.targinfo = &cfg;
+
+	return test_verdict(src_str, skb, change_mark(skb, &param),
+			expected_verdict, expected_mark);
+}
+
+/**
+ * Same as test_change_mark(), except through a revision 0 rule. (Which has
+ * no verdict.)
+ */
+static bool test_change_mark_v0(char *src_str, char *prefix_str, __u8 plen,
+		__u8 splen, __u32 offset, __u32 expected_mark)
+{
+	struct xt_marksrcrange_tginfo_v0 cfg;
+	struct xt_action_param param;
+	struct sk_buff *skb;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (!in6_pton(prefix_str, -1, (u8 *) &cfg.prefix.address, '\0', NULL)) {
+		pr_err("'%s' does not seem to be a v6 address.\n", prefix_str);
+		nays++;
+		return false;
+	}
+	cfg.prefix.len = plen;
+	cfg.mark_offset = offset;
+	cfg.sub_prefix_len = splen;
+
+	skb = create_skb(src_str);
+	if (!skb) {
+		nays++;
+		return false;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.targinfo = &cfg;
+
+	return test_verdict(src_str, skb, change_mark_v0(skb, &param),
+			XT_CONTINUE, expected_mark);
+}
+
+/* (A macro, so it can be glued to other string literals.) */
+#define MANY_FS "ffff:ffff:ffff:ffff:ffff:ffff"
+
 static int msr_init(void)
 {
-	const char *MANY_FS = "ffff:ffff:ffff:ffff:ffff:ffff";
 	bool success = true;
 	pr_info("Starting xt_MARKSRCRANGE tests.\n");
 
@@ -71,6 +236,14 @@ static int msr_init(void)
 	success &= test(MANY_FS ":ffff:fffe", 127, 128, 0, 0);
 	success &= test(MANY_FS ":ffff:ffff", 128, 128, 0, 0);
 
+	/*
+	 * Zero client bits, away from the end of the address.
+	 */
+	success &= test(MANY_FS ":ffff:ffff", 32, 32, 5, 5);
+	success &= test(MANY_FS ":ffff:ffff", 64, 64, 0, 0);
+	success &= test(MANY_FS ":ffff:ffff", 96, 96, 0, 0);
+	success &= test(MANY_FS ":ffff:ffff", 77, 77, 1, 1);
+
 	/*
 	 * Now do everything again, except try the last address of the range.
 	 */
@@ -141,6 +314,48 @@ static int msr_init(void)
 	success &= test("0:0:0:0066:bb00::", 57, 79, 0, 0x335d80);
 	success &= test("::0047:9b00:0000", 83, 121, 1, 0x8f360001);
 
+	/*
+	 * Now go the other way around.
+	 * The prefix's bits beyond the sub-prefix length must not leak.
+	 */
+	success &= test_reverse("2001:db8:1234:5600::", 56, 64, 256, 256,
+			"2001:db8:1234:5600::");
+	success &= test_reverse("2001:db8:1234:5600::", 56, 64, 256, 511,
+			"2001:db8:1234:56ff::");
+	success &= test_reverse("2001:db8::", 112, 128, 0, 0xabcd,
+			"2001:db8::abcd");
+	success &= test_reverse("::", 4, 28, 0, 0x123456, "0123:4560::");
+	success &= test_reverse("::", 98, 127, 0, 0x1a2c55e6, "::3458:abcc");
+	success &= test_reverse("::", 83, 121, 1, 0x8f360001, "::47:9b00:0");
+	success &= test_reverse("2001:db8:ffff:ffff::", 32, 48, 0, 0x1234,
+			"2001:db8:1234::");
+	success &= test_reverse("::", 0, 32, 0, 0xffffffff, "ffff:ffff::");
+	success &= test_reverse("ffff::ffff", 128, 128, 7, 7, "ffff::ffff");
+
+	/*
+	 * Now the whole target.
+	 * CONTINUE marks whatever it gets, since it leaves the decision to the
+	 * rest of the table. ACCEPT only takes its own packets.
+	 */
+	success &= test_change_mark("2001:db8::5", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_CONTINUE, XT_CONTINUE, 261);
+	success &= test_change_mark("2001:db8:1::5", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_CONTINUE, XT_CONTINUE, 261);
+	success &= test_change_mark("2001:db8::5", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_ACCEPT, NF_ACCEPT, 261);
+	success &= test_change_mark("2001:db8::ff", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_ACCEPT, NF_ACCEPT, 511);
+	success &= test_change_mark("2001:db8:1::5", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_ACCEPT, XT_CONTINUE, 0xdeadbeef);
+	success &= test_change_mark("2001:db8::100", "2001:db8::", 120, 128,
+			256, MSR_VERDICT_ACCEPT, XT_CONTINUE, 0xdeadbeef);
+	success &= test_change_mark_v0("2001:db8::5", "2001:db8::", 120, 128,
+			256, 261);
+	success &= test_change_mark_v0("2001:db8:1::5", "2001:db8::", 120, 128,
+			256, 261);
+
+	success &= test_registry(&yays, &nays);
+
 	pr_info("Done. %u tests, %u errors.\n", yays + nays, nays);
 	return success ? 0 : -EINVAL;
 }
@@ -4,27 +4,49 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <xtables.h>
 
+static const struct option opts_v0[] = {
+	{ .name = "mark-offset", .has_arg = 1, .val = 'm' },
+	{ .name = "sub-prefix-len", .has_arg = 1, .val = 's' },
+	{ NULL },
+};
+
 static const struct option opts[] = {
 	{ .name = "mark-offset", .has_arg = 1, .val = 'm' },
 	{ .name = "sub-prefix-len", .has_arg = 1, .val = 's' },
+	{ .name = "verdict", .has_arg = 1, .val = 'v' },
 	{ NULL },
 };
 
 /**
  * Called whenever the user runs `ip6tables -j MARKSRCRANGE -h`.
+ * (This one is only used if the kernel module is too old for revision 1.)
  */
-static void marksrcrange_tg_help(void)
+static void marksrcrange_tg_help_v0(void)
 {
 	printf("MARKSRCRANGE target options:\n");
 	printf("[!] --mark-offset               Number from which to start assigning marks\n");
 	printf("[!] --sub-prefix-len            See https://github.com/NICMx/mark-src-range/issues/1\n");
 }
 
+static void marksrcrange_tg_help(void)
+{
+	marksrcrange_tg_help_v0();
+	printf("    --verdict                   CONTINUE (default) or ACCEPT\n");
+}
+
 /**
  * Called first whenever the user appends a MARKSRCRANGE rule to mangle.
  */
+static void marksrcrange_tg_init_v0(struct xt_entry_target *target)
+{
+	struct xt_marksrcrange_tginfo_v0 *info = (void *)target->data;
+	memset(info, 0, sizeof(*info));
+	info->sub_prefix_len = 128;
+}
+
 static void marksrcrange_tg_init(struct xt_entry_target *target)
 {
 	struct xt_marksrcrange_tginfo *info = (void *)target->data;
@@ -62,10 +84,55 @@ static bool parse_prefix_len(char *argv, __u8 *result)
 	return false;
 }
 
+static const char *verdict_to_str(__u8 verdict)
+{
+	switch (verdict) {
+	case MSR_VERDICT_CONTINUE:
+		return "CONTINUE";
+	case MSR_VERDICT_ACCEPT:
+		return "ACCEPT";
+	}
+
+	return "UNKNOWN";
+}
+
+static bool parse_verdict(char *argv, __u8 *result)
+{
+	if (strcasecmp(argv, "CONTINUE") == 0) {
+		*result = MSR_VERDICT_CONTINUE;
+		return true;
+	}
+	if (strcasecmp(argv, "ACCEPT") == 0) {
+		*result = MSR_VERDICT_ACCEPT;
+		return true;
+	}
+
+	xtables_error(PARAMETER_PROBLEM,
+			"Cannot parse '%s' as a verdict. (Expected CONTINUE or ACCEPT.)",
+			argv);
+	return false;
+}
+
 /**
  * Called after _tg_init once for every argument the ip6tables command bridges
  * to us.
  */
+static int marksrcrange_tg_parse_v0(int c, char **argv, int invert,
+		unsigned int *flags, const void *entry,
+		struct xt_entry_target **target)
+{
+	struct xt_marksrcrange_tginfo_v0 *info = (void *)(*target)->data;
+
+	switch (c) {
+	case 'm':
+		return parse_mark_offset(optarg, &info->mark_offset);
+	case 's':
+		return parse_prefix_len(optarg, &info->sub_prefix_len);
+	}
+
+	return false;
+}
+
 static int marksrcrange_tg_parse(int c, char **argv, int invert,
 		unsigned int *flags, const void *entry,
 		struct xt_entry_target **target)
@@ -77,33 +144,61 @@ static int marksrcrange_tg_parse(int c, char **argv, int invert,
 		return parse_mark_offset(optarg, &info->mark_offset);
 	case 's':
 		return parse_prefix_len(optarg, &info->sub_prefix_len);
+	case 'v':
+		return parse_verdict(optarg, &info->verdict);
 	}
 
 	return false;
 }
 
+static void print_marks(__u32 mark_offset, __u8 prefix_len,
+		__u8 sub_prefix_len)
+{
+	unsigned int max;
+
+	max = (((__u64)1) << (sub_prefix_len - prefix_len)) - 1;
+
+	printf("marks %u-%u (0x%x-0x%x) /%u/%u ",
+			mark_offset, mark_offset + max,
+			mark_offset, mark_offset + max,
+			prefix_len, sub_prefix_len);
+}
+
 /**
  * Called whenever the user runs `ip6tables -t mangle -L`.
  */
+static void marksrcrange_tg_print_v0(const void *entry,
+		const struct xt_entry_target *target,
+		int numeric)
+{
+	const struct xt_marksrcrange_tginfo_v0 *info = (const void *)target->data;
+	print_marks(info->mark_offset, info->prefix.len, info->sub_prefix_len);
+}
+
 static void marksrcrange_tg_print(const void *entry,
 		const struct xt_entry_target *target,
 		int numeric)
 {
 	const struct xt_marksrcrange_tginfo *info = (const void *)target->data;
-	unsigned int max;
-
-	max = (((__u64)1) << (info->sub_prefix_len - info->prefix.len)) - 1;
 
-	printf("marks %u-%u (0x%x-0x%x) /%u/%u ",
-			info->mark_offset, info->mark_offset + max,
-			info->mark_offset, info->mark_offset + max,
-			info->prefix.len, info->sub_prefix_len);
+	print_marks(info->mark_offset, info->prefix.len, info->sub_prefix_len);
+	if (info->verdict != MSR_VERDICT_CONTINUE)
+		printf("verdict %s ", verdict_to_str(info->verdict));
 }
 
 /**
  * Called whenever the user runs `ip6tables-save`.
  * (Remember you might need to sudo.)
  */
+static void marksrcrange_tg_save_v0(const void *entry,
+		const struct xt_entry_target *target)
+{
+	const struct xt_marksrcrange_tginfo_v0 *info = (const void *)target->data;
+	printf(" --mark-offset %u --sub-prefix-len %u",
+			info->mark_offset,
+			info->sub_prefix_len);
+}
+
 static void marksrcrange_tg_save(const void *entry,
 		const struct xt_entry_target *target)
 {
@@ -111,21 +206,39 @@ static void marksrcrange_tg_save(const void *entry,
 	printf(" --mark-offset %u --sub-prefix-len %u",
 			info->mark_offset,
 			info->sub_prefix_len);
+	if (info->verdict != MSR_VERDICT_CONTINUE)
+		printf(" --verdict %s", verdict_to_str(info->verdict));
 }
 
-static struct xtables_target marksrcrange_tg_reg = {
-	.version       = XTABLES_VERSION,
-	.name          = "MARKSRCRANGE",
-	.revision      = 0,
-	.family        = PF_INET6,
-	.size          = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo)),
-	.userspacesize = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo)),
-	.help          = marksrcrange_tg_help,
-	.init          = marksrcrange_tg_init,
-	.parse         = marksrcrange_tg_parse,
-	.print         = marksrcrange_tg_print,
-	.save          = marksrcrange_tg_save,
-	.extra_opts    = opts,
+static struct xtables_target marksrcrange_tg_reg[] = {
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "MARKSRCRANGE",
+		.revision      = 0,
+		.family        = PF_INET6,
+		.size          = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo_v0)),
+		.userspacesize = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo_v0)),
+		.help          = marksrcrange_tg_help_v0,
+		.init          = marksrcrange_tg_init_v0,
+		.parse         = marksrcrange_tg_parse_v0,
+		.print         = marksrcrange_tg_print_v0,
+		.save          = marksrcrange_tg_save_v0,
+		.extra_opts    = opts_v0,
+	},
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "MARKSRCRANGE",
+		.revision      = 1,
+		.family        = PF_INET6,
+		.size          = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo)),
+		.userspacesize = XT_ALIGN(sizeof(struct xt_marksrcrange_tginfo)),
+		.help          = marksrcrange_tg_help,
+		.init          = marksrcrange_tg_init,
+		.parse         = marksrcrange_tg_parse,
+		.print         = marksrcrange_tg_print,
+		.save          = marksrcrange_tg_save,
+		.extra_opts    = opts,
+	},
 };
 
 /**
@@ -134,6 +247,7 @@ static struct xtables_target marksrcrange_tg_reg = {
  */
 static void _init(void)
 {
-	xtables_register_target(&marksrcrange_tg_reg);
+	xtables_register_targets(marksrcrange_tg_reg,
+			ARRAY_SIZE(marksrcrange_tg_reg));
 }
 
@@ -15,14 +15,61 @@ struct ipv6_prefix {
 	__u8 len;
 };
 
+/**
+ * What the target returns after marking a packet.
+ */
+enum marksrcrange_verdict {
+	/** Keep walking the chain. (ie. behave like MARK.) */
+	MSR_VERDICT_CONTINUE = 0,
+	/** Stop walking the table; let the packet through. */
+	MSR_VERDICT_ACCEPT,
+};
+
+/**
+ * Revision 0 of the target's configuration. (ie. before --verdict.)
+ * Still registered, so rules from older plugins keep working.
+ */
+struct xt_marksrcrange_tginfo_v0 {
+	__u32 mark_offset;
+	struct ipv6_prefix prefix;
+	__u8 sub_prefix_len;
+};
+
+/**
+ * Revision 1 of the target's configuration.
+ */
 struct xt_marksrcrange_tginfo {
 	__u32 mark_offset;
 	struct ipv6_prefix prefix;
 	__u8 sub_prefix_len;
+	/** One of enum marksrcrange_verdict. */
+	__u8 verdict;
+	/**
+	 * Whether the rule uses "! --source".
+	 * Like @prefix, filled by the kernel module.
+	 */
+	__u8 src_inverted;
 };
 
 __u32 src_to_mark(const struct in6_addr *src,
 		const struct xt_marksrcrange_tginfo *cfg);
+void mark_to_prefix(const __u32 mark,
+		const struct xt_marksrcrange_tginfo *cfg,
+		struct ipv6_prefix *result);
+
+#ifdef __KERNEL__
+struct net;
+
+/*
+ * Lookups over the MARKSRCRANGE rules currently in a namespace's tables,
+ * exported for other modules' benefit. See mod/registry.c.
+ */
+int marksrcrange_src_to_mark(struct net *net, const struct in6_addr *src,
+		__u32 *mark);
+int marksrcrange_mark_to_prefix(struct net *net, __u32 mark,
+		struct ipv6_prefix *prefix);
+int marksrcrange_sync(struct net *net);
+#endif
 
 #endif /* SRC_XT_MARKSRCRANGE_H_ */
 